@@ -13,11 +13,14 @@ int main(int argc, char **argv) {
   if (!pug_target_build(&libtest)) return 1;
 
   // Test executable. With dependency on libtest.
-  PugTarget test = pug_target_new("test", PUG_TARGET_TYPE_EXECUTABLE, BUILD_DIR);
+  PugTarget test = pug_target_new("test", PUG_TARGET_TYPE_TEST, BUILD_DIR);
   pug_target_add_source(&test, "test.c");
   pug_target_add_cflags(&test, "-Wall", "-Wextra");
   pug_target_add_ldflags(&test, "-L" BUILD_DIR, "-ltest");
   if (!pug_target_build(&test)) return 1;
 
+  // Run test targets with `./pug test`
+  if (pug_arg_bool("test")) return !pug_run_tests();
+
   return 0;
 }
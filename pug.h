@@ -84,10 +84,12 @@ typedef struct _PugTarget PugTarget;
 // PUG_TARGET_TYPE_STATIC_LIBRARY | PUG_TARGET_TYPE_SHARED_LIBRARY will build both static and shared libraries.
 // PUG_TARGET_TYPE_EXECUTABLE | PUG_TARGET_TYPE_STATIC_LIBRARY | PUG_TARGET_TYPE_SHARED_LIBRARY will only build
 // executable.
+// PUG_TARGET_TYPE_TEST builds executable that is run by `pug_run_tests`.
 typedef enum {
   PUG_TARGET_TYPE_EXECUTABLE = 1 << 0,
   PUG_TARGET_TYPE_STATIC_LIBRARY = 1 << 1,
   PUG_TARGET_TYPE_SHARED_LIBRARY = 1 << 2,
+  PUG_TARGET_TYPE_TEST = 1 << 3,
 } PugTargetType;
 
 // Create a new target with the given name, type, and build directory.
@@ -129,9 +131,38 @@ void pug_target_add_pkg_config_lib(PugTarget *target, const char *pkg_config_lib
 #define pug_target_add_pkg_config_libs(target_ptr, ...)                                                                \
   for (const char *_s[] = {__VA_ARGS__, NULL}, **_p = _s; *_p; pug_target_add_pkg_config_lib(target_ptr, *_p), _p++)
 
+// Enable C++20 named modules for `target`.
+// C++ sources are scanned for module dependencies (P1689 format) and compiled in dependency order:
+// module interface units first, then their importers. Scanning uses `clang-scan-deps` with clang
+// and `-fdeps-format=p1689r5` with GCC 14+. Scan results are cached in the build directory.
+void pug_target_enable_modules(PugTarget *target);
+
+// Add input file path of test `target`. Test is rerun when its binary or any of its inputs change.
+void pug_target_add_test_input(PugTarget *target, const char *test_input);
+// Add multiple test inputs to `target`. Convinience macro.
+#define pug_target_add_test_inputs(target_ptr, ...)                                                                    \
+  for (const char *_s[] = {__VA_ARGS__, NULL}, **_p = _s; *_p; pug_target_add_test_input(target_ptr, *_p), _p++)
+
 // Build `target`
 PugResult pug_target_build(PugTarget *target);
 
+// ---------- TESTS ---------- //
+
+// Run all test targets built with `pug_target_build` in parallel. Call it after building all targets:
+//
+//     if (pug_arg_bool("test")) return !pug_run_tests();
+//
+// Tests that passed and didn't change since are skipped. Results are written to JUnit XML file.
+// Command line options:
+//     --shard i/n          Run only i-th of n shards (1-based). Shards are balanced by durations from
+//                          --durations file. Tests missing from it are assumed to take median duration.
+//     --durations <path>   File with test durations shared by all shards. Durations of tests of this shard
+//                          are updated in it.
+//     --timeout <sec>      Kill tests running longer than <sec> seconds. Default is PUG_TEST_TIMEOUT.
+//     --jobs <n>           Run at most <n> tests at once. Default is number of CPUs.
+//     --junit <path>       Path of JUnit XML report. Default is PUG_TEST_JUNIT_FILE.
+PugResult pug_run_tests(void);
+
 // ---------- UTILS ---------- //
 
 // Check if `file1` is older than `file2`
@@ -192,17 +223,25 @@ extern char **pug__argv;
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #ifdef _WIN32
 #include <direct.h>
+#include <sys/utime.h>
 #define stat   _stat
 #define getcwd _getcwd
+#define utime  _utime
 #else
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <utime.h>
 #endif // _WIN32
 
 // ---------- WINDOWS ---------- //
@@ -210,11 +249,14 @@ extern char **pug__argv;
 #ifdef _WIN32
 // C compiler
 #if defined(__clang__)
-#define PUG_CC "clang"
+#define PUG_CC  "clang"
+#define PUG_CXX "clang++"
 #elif defined(__GNUC__)
-#define PUG_CC "gcc"
+#define PUG_CC  "gcc"
+#define PUG_CXX "g++"
 #elif defined(_MSC_VER)
-#define PUG_CC "cl.exe"
+#define PUG_CC  "cl.exe"
+#define PUG_CXX "cl.exe"
 #endif
 // C compiler options
 #define PUG_OBJ_EXT           ".obj"
@@ -227,8 +269,14 @@ extern char **pug__argv;
 // ---------- POSIX ---------- //
 
 #else
-// C compiler
+// C compiler. Clang specific flags are used when built with clang, so `cc` may not be used as it's often gcc.
+#if defined(__clang__)
+#define PUG_CC                "clang"
+#define PUG_CXX               "clang++"
+#else
 #define PUG_CC                "cc"
+#define PUG_CXX               "c++"
+#endif
 // C compiler options
 #define PUG_OBJ_EXT           "o"
 #define PUG_CC_SHARED_LIB_EXT ".so"
@@ -239,6 +287,33 @@ extern char **pug__argv;
 
 #endif // _WIN32
 
+// ---------- C++ MODULES ---------- //
+
+#if defined(__clang__)
+// Built module interface extension
+#define PUG_CXX_BMI_EXT              "pcm"
+// Scan `source` for module dependencies and write P1689 JSON to `ddi`. Args: cflags, source, obj, ddi.
+#define PUG_CXX_SCAN_DEPS_CMD_FORMAT "clang-scan-deps -format=p1689 -- " PUG_CXX " -std=c++20 %s -c %s -o %s > %s"
+#elif defined(__GNUC__)
+#define PUG_CXX_BMI_EXT              "gcm"
+#define PUG_CXX_SCAN_DEPS_CMD_FORMAT                                                                                   \
+  PUG_CXX " -std=c++20 -fmodules-ts %s -x c++ -E %s -fdeps-target=%s -fdeps-file=%s -fdeps-format=p1689r5 -MD "        \
+          "-MF /dev/null -o /dev/null"
+#else
+#define PUG_CXX_BMI_EXT              "ifc"
+#endif
+
+// ---------- PROFILING ---------- //
+
+#if defined(__clang__)
+// Compiler flags to write compile time trace next to object file
+#define PUG_CC_TIME_TRACE_FLAGS "-ftime-trace -ftime-trace-granularity=50"
+#define PUG_CC_TIME_TRACE_EXT   "json"
+#elif defined(__GNUC__)
+#define PUG_CC_TIME_TRACE_FLAGS "-ftime-report"
+#define PUG_CC_TIME_TRACE_EXT   "time-report"
+#endif
+
 // ---------- GLOBAL VARIABLES ---------- //
 
 int pug__argc;
@@ -385,6 +460,8 @@ struct _PugTarget {
   PugArray cflags;
   PugArray ldflags;
   PugArray pkg_config_libs;
+  PugArray test_inputs;
+  bool modules;
 
   PugArray objects;
 };
@@ -398,6 +475,7 @@ PugTarget pug_target_new(const char *name, PugTargetType type, const char *build
   target.cflags = pug__array_init(16);
   target.ldflags = pug__array_init(16);
   target.pkg_config_libs = pug__array_init(16);
+  target.test_inputs = pug__array_init(16);
   target.objects = pug__array_init(16);
 
   return target;
@@ -410,6 +488,14 @@ PUG__TARGET_ADD_FUNC_IMPL(sources, source);
 PUG__TARGET_ADD_FUNC_IMPL(cflags, cflag);
 PUG__TARGET_ADD_FUNC_IMPL(ldflags, ldflag);
 PUG__TARGET_ADD_FUNC_IMPL(pkg_config_libs, pkg_config_lib);
+PUG__TARGET_ADD_FUNC_IMPL(test_inputs, test_input);
+
+void pug_target_enable_modules(PugTarget *target) {
+#ifndef PUG_CXX_SCAN_DEPS_CMD_FORMAT
+  pug_error("C++ modules are not supported with this compiler");
+#endif
+  target->modules = true;
+}
 
 // ---------- CMD TOOLS ---------- //
 
@@ -454,6 +540,13 @@ static PugResult pug__file_exists(const char *path) {
   return PUG_SUCCESS;
 }
 
+// Set modification time of `path` to current time
+static PugResult pug__touch(const char *path) {
+  pug_assert(path != NULL);
+
+  return utime(path, NULL) == 0;
+}
+
 static PugResult pug__create_file(const char *path) {
   pug_assert(path != NULL);
   FILE *fp = fopen(path, "w");
@@ -486,6 +579,30 @@ PugResult pug_file_is_older_than_files(const char *file, ...) {
   return changed;
 }
 
+#define PUG__FNV1A_OFFSET 14695981039346656037ULL
+
+// Update FNV-1a `hash` with `size` bytes of `data`
+static uint64_t pug__fnv1a(uint64_t hash, const void *data, size_t size) {
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 1099511628211ULL;
+
+  return hash;
+}
+
+// Compute FNV-1a hash of `path` contents. Returns 0 if file can't be read.
+static uint64_t pug__file_hash(const char *path) {
+  pug_assert(path != NULL);
+  FILE *fp = fopen(path, "rb");
+  if (!fp) return 0;
+  uint64_t hash = PUG__FNV1A_OFFSET;
+  unsigned char buf[4096];
+  size_t read;
+  while ((read = fread(buf, 1, sizeof(buf), fp)) > 0) hash = pug__fnv1a(hash, buf, read);
+  fclose(fp);
+
+  return hash;
+}
+
 static const char *pug__basename(const char *path) {
   pug_assert(path != NULL);
   const char *base = strrchr(path, '/');
@@ -497,12 +614,14 @@ static const char *pug__basename(const char *path) {
 static const char *pug__dirname(const char *path) {
   pug_assert(path != NULL);
   const char *last_slash = strrchr(path, '/');
-  size_t len = last_slash ? (size_t)(last_slash - path) : 0;
+  if (!last_slash) return ".";
+  if (last_slash == path) return "/";
+  size_t len = (size_t)(last_slash - path);
   char *dirname = pug__alloc(len + 1);
-  if (len) memcpy(dirname, path, len);
+  memcpy(dirname, path, len);
   dirname[len] = '\0';
 
-  return dirname ? dirname : ".";
+  return dirname;
 }
 
 static const char *pug__cwd() {
@@ -547,6 +666,64 @@ static PugArray pug__find_headers(const char *source_file_path) {
   return arr;
 }
 
+// Read whole file into NULL-terminated heap buffer. Caller must `free` it.
+static char *pug__read_file(const char *path) {
+  pug_assert(path != NULL);
+  FILE *file = fopen(path, "rb");
+  if (!file) return NULL;
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  if (size < 0) {
+    fclose(file);
+    return NULL;
+  }
+  char *buf = malloc((size_t)size + 1);
+  pug_assert(buf != NULL);
+  size_t read = fread(buf, 1, (size_t)size, file);
+  buf[read] = '\0';
+  fclose(file);
+
+  return buf;
+}
+
+// Parse JSON string at `ptr` (pointing to opening quote). Escapes are kept as-is.
+// Returns pointer after closing quote or NULL.
+static const char *pug__json_parse_string(const char *ptr, const char **out) {
+  if (*ptr != '"') return NULL;
+  const char *start = ++ptr;
+  while (*ptr && *ptr != '"') ptr += *ptr == '\\' && ptr[1] ? 2 : 1;
+  if (*ptr != '"') return NULL;
+  if (out) *out = pug__sprintf("%.*s", (int)(ptr - start), start);
+
+  return ptr + 1;
+}
+
+// Collect values of "logical-name" keys inside array `key` of P1689 `json`.
+// P1689 "provides" and "requires" arrays contain only flat objects, so first ']' ends the array.
+static void pug__p1689_collect(const char *json, const char *key, PugArray *out) {
+  const char *quoted_key = pug__sprintf("\"%s\"", key);
+  const char *ptr = strstr(json, quoted_key);
+  if (!ptr) return;
+  ptr = strchr(ptr, '[');
+  if (!ptr) return;
+  while (*ptr && *ptr != ']') {
+    if (*ptr == '"') {
+      const char *str = NULL;
+      const char *next = pug__json_parse_string(ptr, &str);
+      if (!next) return;
+      ptr = next;
+      if (strcmp(str, "logical-name") != 0) continue;
+      while (isspace(*ptr) || *ptr == ':') ptr++;
+      const char *name = NULL;
+      next = pug__json_parse_string(ptr, &name);
+      if (!next) return;
+      pug__array_add(out, (void *)name);
+      ptr = next;
+    } else ptr++;
+  }
+}
+
 // ---------- INITIALIZATION ---------- //
 
 // Initialize PUG and rebuild itself if needed
@@ -572,6 +749,942 @@ PugResult pug_arg_bool(const char *arg) {
   return PUG_FAILURE;
 }
 
+// Get value following argument `arg` in command line arguments e.g. "1/2" for "--shard 1/2".
+// Returns NULL if not present. Fails if `arg` is present without value.
+static const char *pug__arg_value(const char *arg) {
+  pug_assert_msg(pug__argc > 0 && pug__argv != NULL,
+                 "Can't parse arguments. Did you forget to call pug_init(argc, argv)?");
+  for (int i = 1; i < pug__argc; i++) {
+    if (strcmp(pug__argv[i], arg) != 0) continue;
+    if (i + 1 == pug__argc) pug_error("Missing value for argument '%s'", arg);
+    return pug__argv[i + 1];
+  }
+
+  return NULL;
+}
+
+// Check if compile time profiling is requested with --profile
+static PugResult pug__profiling(void) { return pug__argc > 0 && pug_arg_bool("--profile"); }
+
+// Check if `obj_file` must be rebuilt with --profile because its compile time trace is missing or stale
+static PugResult pug__time_trace_stale(const char *obj_file) {
+#ifdef PUG_CC_TIME_TRACE_FLAGS
+  if (!pug__profiling()) return PUG_FAILURE;
+  const char *trace_file = pug__replace_ext(obj_file, PUG_CC_TIME_TRACE_EXT);
+
+  return !pug__file_exists(trace_file) || pug_file1_is_older_than_file2(trace_file, obj_file);
+#else
+  return PUG_FAILURE;
+#endif
+}
+
+// Get object file path for `source_file` inside `target` build directory
+static const char *pug__object_file(PugTarget *target, const char *source_file) {
+  // Convert path/to/source.c -> path_to_source.c to avoid collisions
+  const char *source_file_mangled = pug__replace_char(source_file, '/', '_');
+
+  return pug__sprintf("%s/%s", target->build_dir, pug__replace_ext(source_file_mangled, "o"));
+}
+
+// Check if `output` file doesn't exist or older than `source_file` or any of its headers
+static PugResult pug__source_changed(const char *output, const char *source_file) {
+  if (!pug__file_exists(output)) return PUG_SUCCESS;
+  if (pug_file1_is_older_than_file2(output, source_file)) return PUG_SUCCESS;
+  // Check for changed headers
+  PugArray headers = pug__find_headers(source_file);
+  for (size_t i = 0; i < headers.size; i++)
+    if (pug_file1_is_older_than_file2(output, headers.data[i])) return PUG_SUCCESS;
+
+  return PUG_FAILURE;
+}
+
+// Get target cflags together with pkg-config cflags
+static const char *pug__target_cflags(PugTarget *target) {
+  const char *cflags = pug__array_to_string(&target->cflags, " ");
+  const char *pkg_config_libs = pug__array_to_string(&target->pkg_config_libs, " ");
+  // Add pkg-config cflags if needed
+  const char *pkg_config_flags = "";
+#ifndef _WIN32 // Skip pkg-config on Windows
+  if (pkg_config_libs) pkg_config_flags = pug__sprintf("$(pkg-config --cflags %s)", pkg_config_libs);
+#endif
+
+  return pug__sprintf("%s %s", cflags ? cflags : "", pkg_config_flags);
+}
+
+// Compile `source_file` to `obj_file` using `compiler` command
+static PugResult pug__compile_object_file(PugTarget *target, const char *compiler, const char *source_file,
+                                          const char *obj_file) {
+  // Add compile time trace flags with --profile
+  const char *time_trace_flags = "";
+#if defined(PUG_CC_TIME_TRACE_FLAGS) && defined(__clang__)
+  if (pug__profiling()) time_trace_flags = " " PUG_CC_TIME_TRACE_FLAGS;
+#elif defined(PUG_CC_TIME_TRACE_FLAGS)
+  // GCC prints time report to stderr. It's captured to temporary file and kept only if compilation succeeds.
+  const char *trace_tmp_file = pug__sprintf("%s.tmp", pug__replace_ext(obj_file, PUG_CC_TIME_TRACE_EXT));
+  if (pug__profiling()) time_trace_flags = pug__sprintf(" " PUG_CC_TIME_TRACE_FLAGS " 2> %s", trace_tmp_file);
+#endif
+  PugResult res =
+      pug_cmd("%s -c %s -o %s %s%s", compiler, source_file, obj_file, pug__target_cflags(target), time_trace_flags);
+#if defined(PUG_CC_TIME_TRACE_FLAGS) && !defined(__clang__)
+  // Show compiler diagnostics captured together with time report
+  if (pug__profiling()) {
+    char *report = pug__read_file(trace_tmp_file);
+    if (report) {
+      char *report_start = strstr(report, "\nTime variable");
+      if (report_start) *report_start = '\0';
+      fputs(report, stderr);
+      free(report);
+    }
+    if (res) rename(trace_tmp_file, pug__replace_ext(obj_file, PUG_CC_TIME_TRACE_EXT));
+    else remove(trace_tmp_file);
+  }
+#endif
+#ifdef PUG_CC_TIME_TRACE_FLAGS
+  // Compiler may write trace before object file, e.g. GCC writes time report before assembling.
+  // Stamp trace after compilation, so it isn't older than object file it belongs to.
+  if (res && pug__profiling()) pug__touch(pug__replace_ext(obj_file, PUG_CC_TIME_TRACE_EXT));
+#endif
+
+  return res;
+}
+
+// ---------- MODULES ---------- //
+
+// C++ translation unit of target with modules enabled
+typedef struct {
+  const char *source;
+  const char *object;
+  const char *provides; // Name of the module this unit provides or NULL
+  PugArray requires;    // Names of imported modules
+  bool built;
+  bool rebuilt;
+} PugModuleUnit;
+
+static PugResult pug__is_cxx_source(const char *path) {
+  const char *ext = strrchr(pug__basename(path), '.');
+  if (!ext) return PUG_FAILURE;
+  const char *cxx_exts[] = {".cpp", ".cc", ".cxx", ".c++", ".cppm", ".ccm", ".cxxm", ".ixx", ".mpp", NULL};
+  for (const char **p = cxx_exts; *p; p++)
+    if (strcmp(ext, *p) == 0) return PUG_SUCCESS;
+
+  return PUG_FAILURE;
+}
+
+// Get BMI path for module `module_name`. Partition separator ':' is not allowed in file names on Windows.
+static const char *pug__module_bmi_file(PugTarget *target, const char *module_name) {
+  return pug__sprintf("%s/%s." PUG_CXX_BMI_EXT, target->build_dir, pug__replace_char(module_name, ':', '-'));
+}
+
+// Find unit providing module `module_name`. Returns NULL for modules outside of target, e.g. `std`.
+static PugModuleUnit *pug__module_find(PugArray *units, const char *module_name) {
+  for (size_t i = 0; i < units->size; i++) {
+    PugModuleUnit *unit = units->data[i];
+    if (unit->provides && strcmp(unit->provides, module_name) == 0) return unit;
+  }
+
+  return NULL;
+}
+
+// Scan `unit` for provided and imported modules. Scan result is cached in the .ddi file next to object file.
+static PugResult pug__module_scan(PugTarget *target, PugModuleUnit *unit) {
+  const char *ddi_file = pug__replace_ext(unit->object, "ddi");
+  if (pug__source_changed(ddi_file, unit->source)) {
+#ifdef PUG_CXX_SCAN_DEPS_CMD_FORMAT
+    PugResult res = pug_cmd(PUG_CXX_SCAN_DEPS_CMD_FORMAT, pug__target_cflags(target), unit->source, unit->object,
+                            ddi_file);
+#else
+    PugResult res = PUG_FAILURE;
+#endif
+    if (!res) {
+      // Don't leave partial scan result in cache
+      remove(ddi_file);
+      return PUG_FAILURE;
+    }
+  }
+  char *json = pug__read_file(ddi_file);
+  if (!json) return PUG_FAILURE;
+  PugArray provides = pug__array_init(1);
+  pug__p1689_collect(json, "provides", &provides);
+  if (provides.size > 0) unit->provides = provides.data[0];
+  unit->requires = pug__array_init(8);
+  pug__p1689_collect(json, "requires", &unit->requires);
+  free(json);
+
+  return PUG_SUCCESS;
+}
+
+#if defined(__clang__)
+// Add "-fmodule-file=<name>=<bmi>" flags for modules imported by `unit` and their imports
+static void pug__module_add_import_flags(PugTarget *target, PugArray *units, PugModuleUnit *unit, PugArray *flags) {
+  for (size_t i = 0; i < unit->requires.size; i++) {
+    const char *module_name = unit->requires.data[i];
+    PugModuleUnit *dep = pug__module_find(units, module_name);
+    if (!dep) continue;
+    const char *flag = pug__sprintf("-fmodule-file=%s=%s", module_name, pug__module_bmi_file(target, module_name));
+    bool added = false;
+    for (size_t j = 0; j < flags->size && !added; j++) added = strcmp(flags->data[j], flag) == 0;
+    if (added) continue;
+    pug__array_add(flags, (void *)flag);
+    pug__module_add_import_flags(target, units, dep, flags);
+  }
+}
+#endif
+
+// Build C++ sources of `target` in module dependency order
+static PugResult pug__build_module_units(PugTarget *target) {
+  PugArray units = pug__array_init(16);
+  for (size_t i = 0; i < target->sources.size; i++) {
+    const char *source_file = target->sources.data[i];
+    if (!pug__is_cxx_source(source_file)) continue;
+    PugModuleUnit *unit = pug__alloc(sizeof(PugModuleUnit));
+    unit->source = source_file;
+    unit->object = pug__object_file(target, source_file);
+    pug__array_add(&target->objects, (void *)unit->object);
+    if (!pug__module_scan(target, unit)) return PUG_FAILURE;
+    pug__array_add(&units, unit);
+  }
+#if defined(__GNUC__) && !defined(__clang__)
+  // GCC finds BMIs using module mapper file with "<module name> <bmi path>" line for each module
+  const char *mapper_file = pug__sprintf("%s/pug_target_%s.modmap", target->build_dir, target->name);
+  FILE *mapper = fopen(mapper_file, "w");
+  if (!mapper) return PUG_FAILURE;
+  const char *cwd = pug__cwd();
+  for (size_t i = 0; i < units.size; i++) {
+    PugModuleUnit *unit = units.data[i];
+    if (!unit->provides) continue;
+    const char *bmi_file = pug__module_bmi_file(target, unit->provides);
+    if (bmi_file[0] == '/') fprintf(mapper, "%s %s\n", unit->provides, bmi_file);
+    else fprintf(mapper, "%s %s/%s\n", unit->provides, cwd, bmi_file);
+  }
+  fclose(mapper);
+#endif
+  // Compile units whose imported modules are already built until all units are built
+  size_t built = 0;
+  while (built < units.size) {
+    size_t built_before = built;
+    for (size_t i = 0; i < units.size; i++) {
+      PugModuleUnit *unit = units.data[i];
+      if (unit->built) continue;
+      bool ready = true;
+      PugResult unit_needs_build =
+          pug__source_changed(unit->object, unit->source) || pug__time_trace_stale(unit->object);
+      if (unit->provides && !pug__file_exists(pug__module_bmi_file(target, unit->provides)))
+        unit_needs_build = PUG_SUCCESS;
+      // Rebuild importers of changed module interfaces
+      for (size_t j = 0; j < unit->requires.size && ready; j++) {
+        PugModuleUnit *dep = pug__module_find(&units, unit->requires.data[j]);
+        if (!dep) continue;
+        if (!dep->built) ready = false;
+        else if (dep->rebuilt) unit_needs_build = PUG_SUCCESS;
+        else if (pug_file1_is_older_than_file2(unit->object, pug__module_bmi_file(target, dep->provides)))
+          unit_needs_build = PUG_SUCCESS;
+      }
+      if (!ready) continue;
+      if (unit_needs_build) {
+        PugArray flags = pug__array_init(8);
+#if defined(__clang__)
+        if (unit->provides) {
+          const char *bmi_file = pug__module_bmi_file(target, unit->provides);
+          pug__array_add(&flags, "-x c++-module");
+          pug__array_add(&flags, (void *)pug__sprintf("-fmodule-output=%s", bmi_file));
+        }
+        pug__module_add_import_flags(target, &units, unit, &flags);
+#else
+        pug__array_add(&flags, (void *)pug__sprintf("-fmodules-ts -fmodule-mapper=%s -x c++", mapper_file));
+#endif
+        const char *flags_str = pug__array_to_string(&flags, " ");
+        const char *compiler = pug__sprintf(PUG_CXX " -std=c++20 %s", flags_str ? flags_str : "");
+        if (!pug__compile_object_file(target, compiler, unit->source, unit->object)) return PUG_FAILURE;
+        unit->rebuilt = true;
+      }
+      unit->built = true;
+      built++;
+    }
+    if (built == built_before) pug_error("Circular module dependency in target '%s'", target->name);
+  }
+
+  return PUG_SUCCESS;
+}
+
+// ---------- TESTS ---------- //
+
+#ifndef PUG_TEST_TIMEOUT
+#define PUG_TEST_TIMEOUT 300
+#endif
+
+#ifndef PUG_TEST_JUNIT_FILE
+#define PUG_TEST_JUNIT_FILE "pug_test_results.xml"
+#endif
+
+typedef enum {
+  PUG_TEST_PENDING,
+  PUG_TEST_RUNNING,
+  PUG_TEST_PASSED,
+  PUG_TEST_FAILED,
+  PUG_TEST_TIMED_OUT,
+  PUG_TEST_SKIPPED,
+} PugTestStatus;
+
+typedef struct {
+  const char *name;
+  const char *path;
+  PugArray inputs;
+  const char *log_file;      // Test output
+  const char *passed_file;   // Exists if test passed and didn't change since. Contains duration of passed run.
+  double duration;           // Duration of the last run in seconds or -1 if unknown
+  double shard_duration;     // Duration or estimate used for sharding
+  PugTestStatus status;
+  int exit_code;
+  double start_time;
+  double time;
+#ifndef _WIN32
+  pid_t pid;
+#endif
+} PugTest;
+
+// Test targets built with `pug_target_build`
+static PugArray pug__tests;
+
+// Monotonic enough wall clock time in seconds
+static double pug__time(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void pug__register_test(PugTarget *target) {
+  if (!pug__tests.data) pug__tests = pug__array_init(16);
+  PugTest *test = pug__alloc(sizeof(PugTest));
+  test->name = target->name;
+  test->path = pug__sprintf("%s/%s" PUG_CC_EXE_EXT, target->build_dir, target->name);
+  test->inputs = target->test_inputs;
+  test->log_file = pug__sprintf("%s/pug_test_%s.log", target->build_dir, target->name);
+  test->passed_file = pug__sprintf("%s/pug_test_%s_passed", target->build_dir, target->name);
+  test->duration = -1;
+  pug__array_add(&pug__tests, test);
+}
+
+// Load test durations from `path` with "<seconds> <test name>" line for each test
+static void pug__tests_load_durations(const char *path) {
+  char *durations = pug__read_file(path);
+  if (!durations) return;
+  for (char *line = strtok(durations, "\n"); line; line = strtok(NULL, "\n")) {
+    double duration;
+    int name_offset;
+    if (sscanf(line, "%lf %n", &duration, &name_offset) != 1 || duration < 0) continue;
+    for (size_t i = 0; i < pug__tests.size; i++) {
+      PugTest *test = pug__tests.data[i];
+      if (strcmp(test->name, line + name_offset) == 0) test->duration = duration;
+    }
+  }
+  free(durations);
+}
+
+// Save durations of all tests known to `path`
+static void pug__tests_save_durations(const char *path) {
+  FILE *fp = fopen(path, "w");
+  if (!fp) pug_error("Can't write test durations '%s'", path);
+  for (size_t i = 0; i < pug__tests.size; i++) {
+    PugTest *test = pug__tests.data[i];
+    if (test->duration >= 0) fprintf(fp, "%f %s\n", test->duration, test->name);
+  }
+  fclose(fp);
+}
+
+// Sort by duration descending, then by name to get the same order on every machine
+static int pug__test_compare(const void *a, const void *b) {
+  const PugTest *test1 = *(const PugTest **)a;
+  const PugTest *test2 = *(const PugTest **)b;
+  if (test1->shard_duration != test2->shard_duration) return test1->shard_duration < test2->shard_duration ? 1 : -1;
+
+  return strcmp(test1->name, test2->name);
+}
+
+static int pug__double_compare(const void *a, const void *b) {
+  double d1 = *(const double *)a, d2 = *(const double *)b;
+
+  return (d1 > d2) - (d1 < d2);
+}
+
+// Get tests of shard `shard_index` out of `shard_count`.
+// Tests are assigned longest first to the shard with the smallest total duration. Every shard must make the same
+// assignment, so tests without duration get median of known durations, which every shard computes from the same
+// durations file.
+static PugArray pug__tests_shard(size_t shard_index, size_t shard_count) {
+  PugArray sorted = pug__array_init(pug__tests.size);
+  double *known = pug__alloc(pug__tests.size * sizeof(double));
+  size_t known_count = 0;
+  for (size_t i = 0; i < pug__tests.size; i++) {
+    PugTest *test = pug__tests.data[i];
+    if (test->duration >= 0) known[known_count++] = test->duration;
+    pug__array_add(&sorted, test);
+  }
+  // Without any durations tests are split round-robin by name
+  double median = 1;
+  if (known_count) {
+    qsort(known, known_count, sizeof(double), pug__double_compare);
+    median = known_count % 2 ? known[known_count / 2] : (known[known_count / 2 - 1] + known[known_count / 2]) / 2;
+  }
+  for (size_t i = 0; i < sorted.size; i++) {
+    PugTest *test = sorted.data[i];
+    test->shard_duration = test->duration >= 0 ? test->duration : median;
+  }
+  qsort(sorted.data, sorted.size, sizeof(void *), pug__test_compare);
+  PugArray shard = pug__array_init(sorted.size);
+  double *loads = pug__alloc(shard_count * sizeof(double));
+  for (size_t i = 0; i < sorted.size; i++) {
+    size_t lightest = 0;
+    for (size_t j = 1; j < shard_count; j++)
+      if (loads[j] < loads[lightest]) lightest = j;
+    loads[lightest] += ((PugTest *)sorted.data[i])->shard_duration;
+    if (lightest == shard_index) pug__array_add(&shard, sorted.data[i]);
+  }
+
+  return shard;
+}
+
+// Check if test passed before and neither its binary nor inputs changed since
+static PugResult pug__test_unchanged(PugTest *test) {
+  if (!pug__file_exists(test->passed_file)) return PUG_FAILURE;
+  if (pug_file1_is_older_than_file2(test->passed_file, test->path)) return PUG_FAILURE;
+  for (size_t i = 0; i < test->inputs.size; i++) {
+    const char *input = test->inputs.data[i];
+    if (!pug__file_exists(input) || pug_file1_is_older_than_file2(test->passed_file, input)) return PUG_FAILURE;
+  }
+
+  return PUG_SUCCESS;
+}
+
+static PugResult pug__test_start(PugTest *test) {
+  test->start_time = pug__time();
+  test->status = PUG_TEST_RUNNING;
+#ifdef _WIN32
+  // No process management on Windows: run test synchronously without timeout
+  const char *cmd = pug__sprintf("%s > %s 2>&1", test->path, test->log_file);
+  test->exit_code = system(cmd);
+  test->time = pug__time() - test->start_time;
+  test->status = test->exit_code == 0 ? PUG_TEST_PASSED : PUG_TEST_FAILED;
+#else
+  test->pid = fork();
+  if (test->pid < 0) return PUG_FAILURE;
+  if (test->pid == 0) {
+    int fd = open(test->log_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      close(fd);
+    }
+    execl(test->path, test->path, (char *)NULL);
+    _exit(127);
+  }
+#endif
+
+  return PUG_SUCCESS;
+}
+
+// Wait for running tests to finish. Returns number of finished tests.
+static size_t pug__tests_wait(PugArray *tests, double timeout) {
+#ifdef _WIN32
+  return 0;
+#else
+  size_t finished = 0;
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    for (size_t i = 0; i < tests->size; i++) {
+      PugTest *test = tests->data[i];
+      if (test->pid != pid || test->status != PUG_TEST_RUNNING) continue;
+      test->time = pug__time() - test->start_time;
+      test->exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+      test->status = test->exit_code == 0 ? PUG_TEST_PASSED : PUG_TEST_FAILED;
+      finished++;
+    }
+  }
+  // Timed out tests are killed and reaped on the next call
+  for (size_t i = 0; i < tests->size; i++) {
+    PugTest *test = tests->data[i];
+    if (test->status != PUG_TEST_RUNNING || pug__time() - test->start_time < timeout) continue;
+    kill(test->pid, SIGKILL);
+    waitpid(test->pid, NULL, 0);
+    test->time = pug__time() - test->start_time;
+    test->status = PUG_TEST_TIMED_OUT;
+    finished++;
+  }
+  if (!finished) usleep(10 * 1000);
+
+  return finished;
+#endif
+}
+
+// Save test result for skipping unchanged tests and balancing shards next time
+static void pug__test_save_result(PugTest *test) {
+  // Skipped test keeps duration of the run it passed
+  if (test->status == PUG_TEST_SKIPPED) {
+    if (test->duration >= 0) return;
+    FILE *fp = fopen(test->passed_file, "r");
+    if (!fp) return;
+    if (fscanf(fp, "%lf", &test->duration) != 1) test->duration = -1;
+    fclose(fp);
+    return;
+  }
+  test->duration = test->time;
+  if (test->status != PUG_TEST_PASSED) {
+    remove(test->passed_file);
+    return;
+  }
+  FILE *fp = fopen(test->passed_file, "w");
+  if (!fp) return;
+  fprintf(fp, "%f\n", test->time);
+  fclose(fp);
+}
+
+static void pug__xml_write_escaped(FILE *fp, const char *str) {
+  for (const char *p = str; *p; p++) {
+    switch (*p) {
+    case '<': fputs("&lt;", fp); break;
+    case '>': fputs("&gt;", fp); break;
+    case '&': fputs("&amp;", fp); break;
+    case '"': fputs("&quot;", fp); break;
+    default:
+      // Control characters are not allowed in XML 1.0
+      if ((unsigned char)*p < 0x20 && *p != '\n' && *p != '\t' && *p != '\r') break;
+      fputc(*p, fp);
+    }
+  }
+}
+
+static PugResult pug__tests_write_junit(PugArray *tests, const char *path) {
+  FILE *fp = fopen(path, "w");
+  if (!fp) return PUG_FAILURE;
+  size_t failures = 0, skipped = 0;
+  double time = 0;
+  for (size_t i = 0; i < tests->size; i++) {
+    PugTest *test = tests->data[i];
+    if (test->status == PUG_TEST_FAILED || test->status == PUG_TEST_TIMED_OUT) failures++;
+    if (test->status == PUG_TEST_SKIPPED) skipped++;
+    time += test->time;
+  }
+  fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+  fprintf(fp, "<testsuites tests=\"%zu\" failures=\"%zu\" skipped=\"%zu\" time=\"%.3f\">\n", tests->size, failures,
+          skipped, time);
+  fprintf(fp, "  <testsuite name=\"pug\" tests=\"%zu\" failures=\"%zu\" skipped=\"%zu\" time=\"%.3f\">\n", tests->size,
+          failures, skipped, time);
+  for (size_t i = 0; i < tests->size; i++) {
+    PugTest *test = tests->data[i];
+    fprintf(fp, "    <testcase classname=\"pug\" name=\"");
+    pug__xml_write_escaped(fp, test->name);
+    fprintf(fp, "\" time=\"%.3f\">\n", test->time);
+    if (test->status == PUG_TEST_SKIPPED) fprintf(fp, "      <skipped message=\"Unchanged since last pass\"/>\n");
+    if (test->status == PUG_TEST_FAILED) fprintf(fp, "      <failure message=\"Exit code %d\"/>\n", test->exit_code);
+    if (test->status == PUG_TEST_TIMED_OUT) fprintf(fp, "      <failure message=\"Timed out\"/>\n");
+    char *log = test->status == PUG_TEST_SKIPPED ? NULL : pug__read_file(test->log_file);
+    if (log) {
+      fprintf(fp, "      <system-out>");
+      pug__xml_write_escaped(fp, log);
+      fprintf(fp, "</system-out>\n");
+      free(log);
+    }
+    fprintf(fp, "    </testcase>\n");
+  }
+  fprintf(fp, "  </testsuite>\n</testsuites>\n");
+  fclose(fp);
+
+  return PUG_SUCCESS;
+}
+
+PugResult pug_run_tests(void) {
+  // Parse options
+  size_t shard_index = 1, shard_count = 1;
+  const char *shard = pug__arg_value("--shard");
+  if (shard && (sscanf(shard, "%zu/%zu", &shard_index, &shard_count) != 2 || shard_index < 1 ||
+                shard_index > shard_count))
+    pug_error("Invalid shard '%s'. Expected 'i/n' with 1 <= i <= n", shard);
+  double timeout = PUG_TEST_TIMEOUT;
+  const char *timeout_str = pug__arg_value("--timeout");
+  if (timeout_str) {
+    char *end = NULL;
+    timeout = strtod(timeout_str, &end);
+    if (end == timeout_str || *end != '\0' || !(timeout > 0))
+      pug_error("Invalid timeout '%s'. Expected positive number of seconds", timeout_str);
+  }
+#ifdef _WIN32
+  long jobs = 1;
+#else
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  const char *jobs_str = pug__arg_value("--jobs");
+  if (jobs_str) {
+    char *end = NULL;
+    jobs = strtol(jobs_str, &end, 10);
+    if (end == jobs_str || *end != '\0' || jobs < 1)
+      pug_error("Invalid jobs '%s'. Expected positive number of tests to run at once", jobs_str);
+  }
+#ifdef _WIN32
+  // Tests run one by one on Windows
+  jobs = 1;
+#endif
+  if (jobs < 1) jobs = 1;
+  const char *junit_file = pug__arg_value("--junit");
+  if (!junit_file) junit_file = PUG_TEST_JUNIT_FILE;
+  const char *durations_file = pug__arg_value("--durations");
+  if (durations_file) pug__tests_load_durations(durations_file);
+  // Run tests
+  PugArray tests = pug__tests_shard(shard_index - 1, shard_count);
+  pug_info("Running %zu of %zu tests (shard %zu/%zu)", tests.size, pug__tests.size, shard_index, shard_count);
+  for (size_t i = 0; i < tests.size; i++) {
+    PugTest *test = tests.data[i];
+    test->time = 0;
+    if (pug__test_unchanged(test)) test->status = PUG_TEST_SKIPPED;
+  }
+  size_t next = 0, running = 0;
+  while (next < tests.size || running > 0) {
+    for (; next < tests.size && running < (size_t)jobs; next++) {
+      PugTest *test = tests.data[next];
+      if (test->status == PUG_TEST_SKIPPED) continue;
+      if (!pug__test_start(test)) pug_error("Can't start test '%s'", test->name);
+      if (test->status == PUG_TEST_RUNNING) running++;
+    }
+    if (running) running -= pug__tests_wait(&tests, timeout);
+  }
+  // Report results
+  bool passed = true;
+  for (size_t i = 0; i < tests.size; i++) {
+    PugTest *test = tests.data[i];
+    pug__test_save_result(test);
+    if (test->status == PUG_TEST_SKIPPED) {
+      pug_log("SKIP %s", test->name);
+      continue;
+    }
+    if (test->status == PUG_TEST_PASSED) {
+      pug_log("PASS %s (%.2fs)", test->name, test->time);
+      continue;
+    }
+    passed = false;
+    if (test->status == PUG_TEST_TIMED_OUT) pug_log("TIMEOUT %s (%.2fs)", test->name, test->time);
+    else pug_log("FAIL %s (exit code %d, %.2fs). Log: %s", test->name, test->exit_code, test->time, test->log_file);
+  }
+  if (!pug__tests_write_junit(&tests, junit_file)) pug_error("Can't write JUnit report '%s'", junit_file);
+  if (durations_file) pug__tests_save_durations(durations_file);
+  pug_info("Test results -> %s", junit_file);
+
+  return passed;
+}
+
+// ---------- PROFILING ---------- //
+
+#ifndef PUG_PROFILE_TOP
+#define PUG_PROFILE_TOP 30
+#endif
+
+// Aggregated compile time of header, template or compiler pass
+typedef struct {
+  char *name;
+  uint64_t hash;
+  double time;      // Inclusive time in microseconds
+  double self_time; // Time without nested entries in microseconds
+  size_t count;     // Number of translation units or occurrences
+  size_t last_tu;   // Last translation unit counted in `count` (1-based)
+} PugProfileEntry;
+
+// Hash table of profile entries by name
+typedef struct {
+  PugProfileEntry *entries;
+  size_t size;
+  size_t capacity;
+} PugProfileTable;
+
+typedef struct {
+  size_t tus;
+  double frontend;
+  double backend;
+  PugProfileTable headers;
+  PugProfileTable templates;
+  PugProfileTable passes;
+} PugProfile;
+
+#if defined(__clang__)
+// Header parse event of clang time trace
+typedef struct {
+  const char *name;
+  size_t name_len;
+  double ts;
+  double dur;
+  double self;
+} PugTraceSource;
+#endif
+
+// Get entry `name` of `table`, adding it if needed. Profile data can be large, so it's allocated on the heap.
+static PugProfileEntry *pug__profile_table_get(PugProfileTable *table, const char *name, size_t len) {
+  if ((table->size + 1) * 2 > table->capacity) {
+    size_t new_capacity = table->capacity ? table->capacity * 2 : 256;
+    PugProfileEntry *entries = calloc(new_capacity, sizeof(PugProfileEntry));
+    pug_assert(entries != NULL);
+    for (size_t i = 0; i < table->capacity; i++) {
+      if (!table->entries[i].name) continue;
+      size_t j = table->entries[i].hash & (new_capacity - 1);
+      while (entries[j].name) j = (j + 1) & (new_capacity - 1);
+      entries[j] = table->entries[i];
+    }
+    free(table->entries);
+    table->entries = entries;
+    table->capacity = new_capacity;
+  }
+  uint64_t hash = pug__fnv1a(PUG__FNV1A_OFFSET, name, len);
+  size_t i = hash & (table->capacity - 1);
+  for (; table->entries[i].name; i = (i + 1) & (table->capacity - 1)) {
+    PugProfileEntry *entry = &table->entries[i];
+    if (entry->hash == hash && strncmp(entry->name, name, len) == 0 && entry->name[len] == '\0') return entry;
+  }
+  PugProfileEntry *entry = &table->entries[i];
+  entry->name = malloc(len + 1);
+  pug_assert(entry->name != NULL);
+  memcpy(entry->name, name, len);
+  entry->name[len] = '\0';
+  entry->hash = hash;
+  table->size++;
+
+  return entry;
+}
+
+static void pug__profile_table_free(PugProfileTable *table) {
+  for (size_t i = 0; i < table->capacity; i++) free(table->entries[i].name);
+  free(table->entries);
+}
+
+// Add `time` to `entry` and count translation unit `tu` once
+static void pug__profile_entry_add_tu(PugProfileEntry *entry, double time, double self_time, size_t tu) {
+  entry->time += time;
+  entry->self_time += self_time;
+  if (entry->last_tu == tu) return;
+  entry->last_tu = tu;
+  entry->count++;
+}
+
+#if defined(__clang__)
+// Skip JSON value at `ptr`. Returns pointer after the value or NULL.
+static const char *pug__json_skip_value(const char *ptr) {
+  if (*ptr == '"') return pug__json_parse_string(ptr, NULL);
+  if (*ptr != '{' && *ptr != '[') {
+    while (*ptr && *ptr != ',' && *ptr != '}' && *ptr != ']') ptr++;
+    return ptr;
+  }
+  int depth = 0;
+  while (*ptr) {
+    if (*ptr == '"') {
+      ptr = pug__json_parse_string(ptr, NULL);
+      if (!ptr) return NULL;
+      continue;
+    }
+    if (*ptr == '{' || *ptr == '[') depth++;
+    else if ((*ptr == '}' || *ptr == ']') && --depth == 0) return ptr + 1;
+    ptr++;
+  }
+
+  return NULL;
+}
+
+// Sort header events by start time, outer events first
+static int pug__trace_source_compare(const void *a, const void *b) {
+  const PugTraceSource *source1 = a, *source2 = b;
+  if (source1->ts != source2->ts) return source1->ts < source2->ts ? -1 : 1;
+  if (source1->dur != source2->dur) return source1->dur > source2->dur ? -1 : 1;
+
+  return 0;
+}
+
+// Add clang `-ftime-trace` JSON of translation unit `tu` to `profile`
+static void pug__profile_add_time_trace(PugProfile *profile, const char *json, size_t tu) {
+  const char *ptr = strstr(json, "\"traceEvents\"");
+  if (!ptr || !(ptr = strchr(ptr, '['))) return;
+  ptr++;
+  PugTraceSource *sources = NULL;
+  size_t sources_size = 0, sources_capacity = 0;
+  while (ptr) {
+    while (isspace(*ptr) || *ptr == ',') ptr++;
+    if (*ptr != '{') break;
+    ptr++;
+    // Parse event members we are interested in
+    const char *name = "", *detail = "";
+    size_t name_len = 0, detail_len = 0;
+    double ts = 0, dur = 0;
+    while (ptr) {
+      while (isspace(*ptr) || *ptr == ',') ptr++;
+      if (*ptr == '}') {
+        ptr++;
+        break;
+      }
+      const char *key = ptr;
+      ptr = pug__json_parse_string(ptr, NULL);
+      if (!ptr) break;
+      while (isspace(*ptr) || *ptr == ':') ptr++;
+      const char *value = ptr;
+      ptr = pug__json_skip_value(value);
+      if (!ptr) break;
+      if (strncmp(key, "\"name\":", 7) == 0 && *value == '"') name = value + 1, name_len = ptr - value - 2;
+      else if (strncmp(key, "\"ts\":", 5) == 0) ts = strtod(value, NULL);
+      else if (strncmp(key, "\"dur\":", 6) == 0) dur = strtod(value, NULL);
+      else if (strncmp(key, "\"args\":", 7) == 0) {
+        for (const char *p = value; p < ptr; p++) {
+          if (strncmp(p, "\"detail\"", 8) != 0) continue;
+          p += 8;
+          while (isspace(*p) || *p == ':') p++;
+          const char *end = pug__json_parse_string(p, NULL);
+          if (end) detail = p + 1, detail_len = end - p - 2;
+          break;
+        }
+      }
+    }
+    if (!ptr) break;
+#define PUG__NAME_IS(str) (name_len == sizeof(str) - 1 && strncmp(name, str, name_len) == 0)
+    if (PUG__NAME_IS("Source") && detail_len) {
+      if (sources_size == sources_capacity) {
+        sources_capacity = sources_capacity ? sources_capacity * 2 : 256;
+        sources = realloc(sources, sources_capacity * sizeof(PugTraceSource));
+        pug_assert(sources != NULL);
+      }
+      sources[sources_size++] = (PugTraceSource){detail, detail_len, ts, dur, dur};
+    } else if ((PUG__NAME_IS("InstantiateClass") || PUG__NAME_IS("InstantiateFunction")) && detail_len) {
+      PugProfileEntry *entry = pug__profile_table_get(&profile->templates, detail, detail_len);
+      entry->time += dur;
+      entry->count++;
+    } else if (PUG__NAME_IS("Total Frontend")) profile->frontend += dur;
+    else if (PUG__NAME_IS("Total Backend")) profile->backend += dur;
+#undef PUG__NAME_IS
+  }
+  // Headers include each other: subtract time of directly nested headers to get self time
+  qsort(sources, sources_size, sizeof(PugTraceSource), pug__trace_source_compare);
+  size_t *stack = malloc((sources_size + 1) * sizeof(size_t));
+  pug_assert(stack != NULL);
+  size_t stack_size = 0;
+  for (size_t i = 0; i < sources_size; i++) {
+    while (stack_size && sources[stack[stack_size - 1]].ts + sources[stack[stack_size - 1]].dur <= sources[i].ts)
+      stack_size--;
+    if (stack_size) sources[stack[stack_size - 1]].self -= sources[i].dur;
+    stack[stack_size++] = i;
+  }
+  for (size_t i = 0; i < sources_size; i++) {
+    PugProfileEntry *entry = pug__profile_table_get(&profile->headers, sources[i].name, sources[i].name_len);
+    pug__profile_entry_add_tu(entry, sources[i].dur, sources[i].self, tu);
+  }
+  free(stack);
+  free(sources);
+}
+#elif defined(__GNUC__)
+// Add GCC `-ftime-report` output of translation unit `tu` to `profile`
+static void pug__profile_add_time_report(PugProfile *profile, const char *report, size_t tu) {
+  for (const char *line = report; line && *line; line = strchr(line, '\n'), line = line ? line + 1 : NULL) {
+    const char *colon = strchr(line, ':');
+    const char *line_end = strchr(line, '\n');
+    if (!colon || (line_end && colon > line_end)) continue;
+    double usr, sys, wall;
+    if (sscanf(colon + 1, "%lf (%*[^)]) %lf (%*[^)]) %lf", &usr, &sys, &wall) != 3) continue;
+    wall *= 1e6;
+    // Time variable name: " phase parsing   :" or nested " |name lookup   :"
+    const char *name = line;
+    while (isspace(*name) || *name == '|') name++;
+    size_t name_len = colon - name;
+    while (name_len && isspace(name[name_len - 1])) name_len--;
+    if (strncmp(name, "phase ", 6) == 0) {
+      if (strncmp(name, "phase opt and generate", name_len) == 0) profile->backend += wall;
+      else if (strncmp(name, "phase finalize", name_len) != 0) profile->frontend += wall;
+      continue;
+    }
+    pug__profile_entry_add_tu(pug__profile_table_get(&profile->passes, name, name_len), wall, wall, tu);
+  }
+}
+#endif
+
+static int pug__profile_entry_compare(const void *a, const void *b) {
+  const PugProfileEntry *entry1 = *(const PugProfileEntry **)a, *entry2 = *(const PugProfileEntry **)b;
+  if (entry1->time != entry2->time) return entry1->time < entry2->time ? 1 : -1;
+  if (entry1->count != entry2->count) return entry1->count < entry2->count ? 1 : -1;
+
+  return strcmp(entry1->name, entry2->name);
+}
+
+// Write PUG_PROFILE_TOP most expensive entries of `table`
+static void pug__profile_write_table(FILE *fp, PugProfileTable *table, const char *title, const char *count_title,
+                                     bool with_self) {
+  if (table->size == 0) return;
+  PugProfileEntry **sorted = malloc(table->size * sizeof(PugProfileEntry *));
+  pug_assert(sorted != NULL);
+  size_t size = 0;
+  for (size_t i = 0; i < table->capacity; i++)
+    if (table->entries[i].name) sorted[size++] = &table->entries[i];
+  qsort(sorted, size, sizeof(PugProfileEntry *), pug__profile_entry_compare);
+  fprintf(fp, "\n%s:\n", title);
+  if (with_self) fprintf(fp, "%12s %12s %8s  %s\n", "total ms", "self ms", count_title, "name");
+  else fprintf(fp, "%12s %8s  %s\n", "total ms", count_title, "name");
+  for (size_t i = 0; i < size && i < PUG_PROFILE_TOP; i++) {
+    PugProfileEntry *entry = sorted[i];
+    if (with_self)
+      fprintf(fp, "%12.1f %12.1f %8zu  %s\n", entry->time / 1000, entry->self_time / 1000, entry->count, entry->name);
+    else fprintf(fp, "%12.1f %8zu  %s\n", entry->time / 1000, entry->count, entry->name);
+  }
+  free(sorted);
+}
+
+static void pug__profile_write(FILE *fp, PugTarget *target, PugProfile *profile) {
+  double total = profile->frontend + profile->backend;
+  fprintf(fp, "Compile time profile of target '%s' (%zu translation units)\n\n", target->name, profile->tus);
+  fprintf(fp, "Frontend: %12.1f ms (%.0f%%)\n", profile->frontend / 1000, total ? profile->frontend / total * 100 : 0);
+  fprintf(fp, "Backend:  %12.1f ms (%.0f%%)\n", profile->backend / 1000, total ? profile->backend / total * 100 : 0);
+#if defined(__clang__)
+  pug__profile_write_table(fp, &profile->headers, "Most expensive headers", "TUs", true);
+#else
+  pug__profile_write_table(fp, &profile->headers, "Most included headers (no time per header with GCC)", "TUs", false);
+#endif
+  pug__profile_write_table(fp, &profile->templates, "Most expensive template instantiations", "count", false);
+  pug__profile_write_table(fp, &profile->passes, "Most expensive compiler passes", "TUs", false);
+}
+
+// Aggregate compile time traces of `target` objects into ranked report
+static void pug__profile_target(PugTarget *target) {
+#ifndef PUG_CC_TIME_TRACE_FLAGS
+  pug_log("Compile time profiling is not supported with this compiler");
+#else
+  PugProfile profile = {0};
+  for (size_t i = 0; i < target->sources.size; i++) {
+    const char *source_file = target->sources.data[i];
+    const char *obj_file = pug__object_file(target, source_file);
+    const char *trace_file = pug__replace_ext(obj_file, PUG_CC_TIME_TRACE_EXT);
+    // Trace is stale if object was rebuilt without profiling after it
+    if (!pug__file_exists(trace_file) || pug_file1_is_older_than_file2(trace_file, obj_file)) continue;
+    char *trace = pug__read_file(trace_file);
+    if (!trace) continue;
+    profile.tus++;
+#if defined(__clang__)
+    pug__profile_add_time_trace(&profile, trace, profile.tus);
+#else
+    pug__profile_add_time_report(&profile, trace, profile.tus);
+    // GCC doesn't report time per header: count translation units including project headers
+    PugArray headers = pug__find_headers(source_file);
+    for (size_t j = 0; j < headers.size; j++) {
+      const char *header = headers.data[j];
+      pug__profile_entry_add_tu(pug__profile_table_get(&profile.headers, header, strlen(header)), 0, 0, profile.tus);
+    }
+#endif
+    free(trace);
+  }
+  if (profile.tus == 0) {
+    pug_log("No compile time traces for target '%s'. Rebuild it with --profile.", target->name);
+    return;
+  }
+  const char *report_file = pug__sprintf("%s/pug_target_%s_profile.txt", target->build_dir, target->name);
+  FILE *fp = fopen(report_file, "w");
+  if (fp) {
+    pug__profile_write(fp, target, &profile);
+    fclose(fp);
+  }
+  pug__profile_write(stderr, target, &profile);
+  pug_info("Compile time profile -> %s", report_file);
+  pug__profile_table_free(&profile.headers);
+  pug__profile_table_free(&profile.templates);
+  pug__profile_table_free(&profile.passes);
+#endif
+}
+
 // ---------- BUILD ---------- //
 
 static void pug__check_pkg_config_libs(PugTarget *target) {
@@ -591,56 +1704,155 @@ static void pug__check_pkg_config_libs(PugTarget *target) {
   pug__create_file(pkg_config_checked_file);
 }
 
-static PugResult pug__build_object_files(PugTarget *target, bool *need_linking) {
+static PugResult pug__build_object_files(PugTarget *target) {
   for (size_t i = 0; i < target->sources.size; i++) {
     const char *source_file = target->sources.data[i];
     if (!pug__file_exists(source_file)) pug_error("Source file does not exist: %s", source_file);
-    // Convert path/to/source.c -> path_to_source.c to avoid collisions
-    const char *source_file_mangled = pug__replace_char(source_file, '/', '_');
-    const char *obj_file = pug__sprintf("%s/%s", target->build_dir, pug__replace_ext(source_file_mangled, "o"));
+    // C++ sources of modules enabled target are built in module dependency order
+    if (target->modules && pug__is_cxx_source(source_file)) continue;
+    const char *obj_file = pug__object_file(target, source_file);
     pug__array_add(&target->objects, (void *)obj_file);
-    // Check if source file needs building
-    PugResult source_needs_build = PUG_FAILURE;
-    if (!pug__file_exists(obj_file)) source_needs_build = PUG_SUCCESS;
-    if (pug_file1_is_older_than_file2(obj_file, source_file)) source_needs_build = PUG_SUCCESS;
-    // Check for changed headers
-    PugArray headers = pug__find_headers(source_file);
-    for (size_t i = 0; i < headers.size; i++)
-      if (pug_file1_is_older_than_file2(obj_file, headers.data[i])) source_needs_build = PUG_SUCCESS;
     // Build obj file if needed
-    if (source_needs_build) {
-      *need_linking = PUG_SUCCESS;
-      const char *cflags = pug__array_to_string(&target->cflags, " ");
-      const char *pkg_config_libs = pug__array_to_string(&target->pkg_config_libs, " ");
-      // Add pkg-config cflags if needed
-      const char *pkg_config_flags = "";
-#ifndef _WIN32 // Skip pkg-config on Windows
-      if (pkg_config_libs) pkg_config_flags = pug__sprintf("$(pkg-config --cflags %s)", pkg_config_libs);
-#endif
-      // Run command
-      PugResult res = pug_cmd(PUG_CC " -c %s -o %s %s %s", source_file, obj_file, cflags, pkg_config_flags);
-      if (!res) return PUG_FAILURE;
-    }
+    if (pug__source_changed(obj_file, source_file) || pug__time_trace_stale(obj_file))
+      if (!pug__compile_object_file(target, PUG_CC, source_file, obj_file)) return PUG_FAILURE;
   }
+  if (target->modules) return pug__build_module_units(target);
 
   return PUG_SUCCESS;
 }
 
+// Get paths of files produced by linking `target`
+static PugArray pug__target_outputs(PugTarget *target) {
+  const char *path = pug__sprintf("%s/%s", target->build_dir, target->name);
+  PugArray outputs = pug__array_init(2);
+  if (target->type & (PUG_TARGET_TYPE_EXECUTABLE | PUG_TARGET_TYPE_TEST)) {
+    pug__array_add(&outputs, (void *)pug__sprintf("%s" PUG_CC_EXE_EXT, path));
+    return outputs;
+  }
+  if (target->type & PUG_TARGET_TYPE_STATIC_LIBRARY)
+    pug__array_add(&outputs, (void *)pug__sprintf("%s" PUG_CC_STATIC_LIB_EXT, path));
+  if (target->type & PUG_TARGET_TYPE_SHARED_LIBRARY)
+    pug__array_add(&outputs, (void *)pug__sprintf("%s" PUG_CC_SHARED_LIB_EXT, path));
+
+  return outputs;
+}
+
+// Get paths of existing library files `target` links to with "-L<dir>" and "-l<name>" or library path ldflags
+static PugArray pug__target_libs(PugTarget *target) {
+  PugArray lib_dirs = pug__array_init(4);
+  PugArray lib_names = pug__array_init(8);
+  PugArray libs = pug__array_init(8);
+  for (size_t i = 0; i < target->ldflags.size; i++) {
+    // Single ldflag may contain multiple flags, e.g. "-Lbuild -ltest"
+    char *flags = (char *)pug__sprintf("%s", (const char *)target->ldflags.data[i]);
+    for (char *flag = strtok(flags, " \t"); flag; flag = strtok(NULL, " \t")) {
+      size_t len = strlen(flag);
+      if (strncmp(flag, "-L", 2) == 0 && len > 2) pug__array_add(&lib_dirs, flag + 2);
+      else if (strncmp(flag, "-l", 2) == 0 && len > 2) pug__array_add(&lib_names, flag + 2);
+      else if (pug__file_exists(flag)) pug__array_add(&libs, flag);
+    }
+  }
+  for (size_t i = 0; i < lib_names.size; i++) {
+    for (size_t j = 0; j < lib_dirs.size; j++) {
+      const char *dir = lib_dirs.data[j], *name = lib_names.data[i];
+      const char *candidates[] = {
+          pug__sprintf("%s/lib%s" PUG_CC_STATIC_LIB_EXT, dir, name),
+          pug__sprintf("%s/lib%s" PUG_CC_SHARED_LIB_EXT, dir, name),
+          pug__sprintf("%s/%s" PUG_CC_STATIC_LIB_EXT, dir, name),
+          pug__sprintf("%s/%s" PUG_CC_SHARED_LIB_EXT, dir, name),
+      };
+      for (size_t k = 0; k < sizeof(candidates) / sizeof(candidates[0]); k++)
+        if (pug__file_exists(candidates[k])) pug__array_add(&libs, (void *)candidates[k]);
+    }
+  }
+
+  return libs;
+}
+
+// Get path of file with "<hash> <object path>" line for each object `target` was last linked with
+static const char *pug__target_objects_manifest(PugTarget *target) {
+  return pug__sprintf("%s/pug_target_%s_objects", target->build_dir, target->name);
+}
+
+// Save hashes of objects `target` was linked with
+static void pug__target_save_objects_manifest(PugTarget *target) {
+  const char *manifest_file = pug__target_objects_manifest(target);
+  FILE *fp = fopen(manifest_file, "w");
+  if (!fp) pug_error("Can't write objects manifest '%s'", manifest_file);
+  for (size_t i = 0; i < target->objects.size; i++) {
+    const char *obj_file = target->objects.data[i];
+    fprintf(fp, "%016llx %s\n", (unsigned long long)pug__file_hash(obj_file), obj_file);
+  }
+  fclose(fp);
+}
+
+// Check if any object of `target` differs from objects it was last linked with.
+// Objects older than all link outputs are skipped, others are hashed: recompiled objects are often byte-identical,
+// e.g. after comment-only edits.
+static PugResult pug__target_objects_changed(PugTarget *target, PugArray *outputs) {
+  char *manifest = pug__read_file(pug__target_objects_manifest(target));
+  if (!manifest) return PUG_SUCCESS;
+  PugArray paths = pug__array_init(target->objects.size);
+  PugArray hashes = pug__array_init(target->objects.size);
+  for (char *line = strtok(manifest, "\n"); line; line = strtok(NULL, "\n")) {
+    char *path = NULL;
+    unsigned long long hash = strtoull(line, &path, 16);
+    if (*path != ' ') continue;
+    pug__array_add(&paths, (void *)pug__sprintf("%s", path + 1));
+    pug__array_add(&hashes, (void *)pug__sprintf("%016llx", hash));
+  }
+  free(manifest);
+  if (paths.size != target->objects.size) return PUG_SUCCESS;
+  for (size_t i = 0; i < target->objects.size; i++) {
+    const char *obj_file = target->objects.data[i];
+    const char *linked_hash = NULL;
+    for (size_t j = 0; j < paths.size && !linked_hash; j++)
+      if (strcmp(paths.data[j], obj_file) == 0) linked_hash = hashes.data[j];
+    if (!linked_hash) return PUG_SUCCESS;
+    // Build could stop between linking outputs, e.g. after static library but before shared one
+    bool older_than_outputs = outputs->size > 0;
+    for (size_t j = 0; j < outputs->size && older_than_outputs; j++)
+      older_than_outputs = pug_file1_is_older_than_file2(obj_file, outputs->data[j]);
+    if (older_than_outputs) continue;
+    const char *hash = pug__sprintf("%016llx", (unsigned long long)pug__file_hash(obj_file));
+    if (strcmp(hash, linked_hash) != 0) return PUG_SUCCESS;
+  }
+
+  return PUG_FAILURE;
+}
+
+// Check if any `target` output is missing, its objects changed since last link or it's older than libraries
+// it links to. Libraries are relinked only when their objects change, so dependent targets are relinked only
+// when needed.
+static PugResult pug__target_needs_relinking(PugTarget *target) {
+  PugArray outputs = pug__target_outputs(target);
+  PugArray libs = pug__target_libs(target);
+  for (size_t i = 0; i < outputs.size; i++) {
+    if (!pug__file_exists(outputs.data[i])) return PUG_SUCCESS;
+    for (size_t j = 0; j < libs.size; j++)
+      if (pug_file1_is_older_than_file2(outputs.data[i], libs.data[j])) return PUG_SUCCESS;
+  }
+
+  return pug__target_objects_changed(target, &outputs);
+}
+
 static PugResult pug__link_object_files(PugTarget *target) {
   const char *path = pug__sprintf("%s/%s", target->build_dir, target->name);
   const char *obj_str = pug__array_to_string(&target->objects, " ");
   const char *pkg_config_libs = pug__array_to_string(&target->pkg_config_libs, " ");
   const char *ldflags = pug__array_to_string(&target->ldflags, " ");
+  // Objects built from C++ modules need C++ runtime
+  const char *linker = target->modules ? PUG_CXX : PUG_CC;
   // Add pkg-config ldflags if needed
   const char *pkg_config_flags = "";
 #ifndef _WIN32 // Skip pkg-config on Windows
   if (pkg_config_libs) pkg_config_flags = pug__sprintf("$(pkg-config --libs %s)", pkg_config_libs);
 #endif
   // Link executable
-  if (target->type & PUG_TARGET_TYPE_EXECUTABLE) {
+  if (target->type & (PUG_TARGET_TYPE_EXECUTABLE | PUG_TARGET_TYPE_TEST)) {
     pug_info("Linking executable -> %s", path);
     PugResult res =
-        pug_cmd(PUG_CC " %s" PUG_CC_EXE_EXT " -o %s %s %s", obj_str, path, ldflags ? ldflags : "", pkg_config_flags);
+        pug_cmd("%s %s" PUG_CC_EXE_EXT " -o %s %s %s", linker, obj_str, path, ldflags ? ldflags : "", pkg_config_flags);
     if (!res) return PUG_FAILURE;
   } else {
     // Link static library
@@ -652,7 +1864,7 @@ static PugResult pug__link_object_files(PugTarget *target) {
     // Link dynamic library
     if (target->type & PUG_TARGET_TYPE_SHARED_LIBRARY) {
       pug_info("Linking dynamic library -> %s", path);
-      PugResult res = pug_cmd(PUG_CC " -shared %s -o %s" PUG_CC_SHARED_LIB_EXT " %s %s", obj_str, path,
+      PugResult res = pug_cmd("%s -shared %s -o %s" PUG_CC_SHARED_LIB_EXT " %s %s", linker, obj_str, path,
                               ldflags ? ldflags : "", pkg_config_flags);
       if (!res) return PUG_FAILURE;
     }
@@ -674,10 +1886,13 @@ PugResult pug_target_build(PugTarget *target) {
   pug__check_pkg_config_libs(target);
   // Build
   pug_info("Building target '%s'", target->name);
-  bool needs_linking = false;
-  if (!pug__build_object_files(target, &needs_linking)) return PUG_FAILURE;
-  if (needs_linking)
+  if (!pug__build_object_files(target)) return PUG_FAILURE;
+  if (pug__target_needs_relinking(target)) {
     if (!pug__link_object_files(target)) return PUG_FAILURE;
+    pug__target_save_objects_manifest(target);
+  }
+  if (target->type & PUG_TARGET_TYPE_TEST) pug__register_test(target);
+  if (pug__profiling()) pug__profile_target(target);
 
   return PUG_SUCCESS;
 }